@@ -0,0 +1,129 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Bundle reader. Maps a packed directory once so requests can be answered
+ * without touching the filesystem.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "policy.h"
+
+struct bundle {
+  char *map;
+  size_t size;
+  uint32_t count;
+  const struct bundle_entry *entries;
+  // parallel to `entries`
+  const struct cache_policy **policies;
+};
+
+static bool valid_blob(const struct bundle *, struct bundle_blob, bool string);
+
+struct bundle *bundle_open(const char *const filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat stat_info;
+  if (fd == -1 || fstat(fd, &stat_info) != 0) {
+    perror("Could not open bundle");
+    if (fd != -1) close(fd);
+    return NULL;
+  }
+  if ((size_t)stat_info.st_size < sizeof(struct bundle_header)) {
+    fprintf(stderr, "%s is too small to be a bundle\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  struct bundle *b = malloc(sizeof(struct bundle));
+  b->policies = NULL;
+  b->size = stat_info.st_size;
+  b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (b->map == MAP_FAILED) {
+    perror("Could not mmap bundle");
+    free(b);
+    return NULL;
+  }
+
+  const struct bundle_header *header = (const struct bundle_header *)b->map;
+  b->count = header->count;
+  b->entries = (const struct bundle_entry *)(b->map + header->index);
+  if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != BUNDLE_VERSION
+      || header->index % sizeof(uint64_t) != 0
+      || header->index > b->size
+      || (b->size - header->index) / sizeof(struct bundle_entry) < b->count) {
+    fprintf(stderr, "%s is not a valid bundle\n", filename);
+    bundle_close(b);
+    return NULL;
+  }
+  // check everything once here so lookups never have to
+  b->policies = malloc(b->count * sizeof(struct cache_policy *));
+  for (uint32_t i = 0; i < b->count; i++) {
+    const struct bundle_entry *e = b->entries + i;
+    if (!valid_blob(b, e->path, true) || !valid_blob(b, e->file, true)
+        || !valid_blob(b, e->mimetype, true)
+        || !valid_blob(b, e->headers, true) || !valid_blob(b, e->body, false)
+        || !valid_blob(b, e->gzip_headers, true)
+        || !valid_blob(b, e->gzip_body, false)) {
+      fprintf(stderr, "%s has a corrupt entry at index %u\n", filename, i);
+      bundle_close(b);
+      return NULL;
+    }
+    const char *mimetype = b->map + e->mimetype.offset;
+    b->policies[i] = get_cache_policy(b->map + e->path.offset,
+                                      b->map + e->file.offset,
+                                      *mimetype ? mimetype : NULL);
+  }
+  return b;
+}
+
+const struct bundle_entry *bundle_find(const struct bundle *b,
+                                       const char *const path) {
+  uint32_t low = 0, high = b->count;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    int cmp = strcmp(path, b->map + b->entries[mid].path.offset);
+    if (cmp == 0) return b->entries + mid;
+    if (cmp < 0) high = mid;
+    else low = mid + 1;
+  }
+  return NULL;
+}
+
+const struct cache_policy *bundle_policy(const struct bundle *b,
+                                         const struct bundle_entry *entry) {
+  return b->policies[entry - b->entries];
+}
+
+const char *bundle_data(const struct bundle *b, const struct bundle_blob blob) {
+  return b->map + blob.offset;
+}
+
+void bundle_close(struct bundle *b) {
+  munmap(b->map, b->size);
+  free(b->policies);
+  free(b);
+}
+
+/* Local routines */
+
+static bool valid_blob(const struct bundle *b, const struct bundle_blob blob,
+                       const bool string) {
+  if (blob.offset > b->size || b->size - blob.offset < blob.length)
+    return false;
+  if (!string) return true;
+  // room for the NUL terminator, and it's actually there
+  return b->size - blob.offset > blob.length
+         && b->map[blob.offset + blob.length] == '\0';
+}
@@ -0,0 +1,55 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+#include <stddef.h>
+#include <stdint.h>
+
+// A bundle is a whole directory tree packed into one file by `pack`.
+// Layout (all integers are native endian, the bundle isn't portable):
+//   struct bundle_header
+//   for every file: path, mimetype and headers (NUL terminated),
+//                   then the contents and gzip variant, each page aligned
+//   struct bundle_entry[count], sorted by path
+#define BUNDLE_MAGIC "TSBUNDLE"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ALIGN 4096
+
+struct bundle_header {
+  char magic[8];
+  uint32_t version, count;
+  uint64_t index;  // offset of the first bundle_entry
+};
+
+// a region of the bundle. strings are NUL terminated,
+// but the NUL isn't counted in `length`
+struct bundle_blob {
+  uint64_t offset, length;
+};
+
+struct bundle_entry {
+  // `file` is where it came from: different from `path` for directory indices
+  struct bundle_blob path, file, mimetype;
+  // every header that depends only on the file, already formatted
+  struct bundle_blob headers, body;
+  // `length` is 0 if there is no precompressed variant
+  struct bundle_blob gzip_headers, gzip_body;
+};
+
+struct bundle;
+struct cache_policy;
+
+// Returns NULL if the bundle is missing or corrupt.
+// Cache policies must already be loaded, they're resolved here once per entry
+struct bundle *bundle_open(const char *filename);
+// Returns NULL if `path` isn't in the bundle
+const struct bundle_entry *bundle_find(const struct bundle *, const char *path);
+// Returns NULL if no cache policy applies to `entry`
+const struct cache_policy *bundle_policy(const struct bundle *,
+                                         const struct bundle_entry *entry);
+// Pointer to the contents of a blob, valid until bundle_close
+const char *bundle_data(const struct bundle *, struct bundle_blob);
+void bundle_close(struct bundle *);
+#endif  // BUNDLE_H
@@ -0,0 +1,207 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Hot restart. Passes the listening socket to a freshly exec'd copy of the
+ * server so that a new binary can be deployed without refusing connections.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "handoff.h"
+
+// holds the file descriptor of the unix socket connected to the old process
+#define HANDOFF_ENV "THREADED_SERVER_HANDOFF_FD"
+
+extern char **environ;
+
+// set by receive_listener, used by acknowledge_handoff
+static int channel = -1;
+
+static bool find_executable(const char *name, char *path);
+static char **make_environment(int fd);
+static bool wait_for_ack(int fd);
+
+int receive_listener(void) {
+  const char *value = getenv(HANDOFF_ENV);
+  if (value == NULL) return -1;
+  channel = atoi(value);
+  // don't pass this on to our own successor
+  unsetenv(HANDOFF_ENV);
+  fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+  char dummy;
+  struct iovec iov = {&dummy, 1};
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message = {0};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buf;
+  message.msg_controllen = sizeof(control.buf);
+
+  if (recvmsg(channel, &message, 0) <= 0) {
+    perror("Failed to receive listening socket");
+    close(channel);
+    channel = -1;
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "Old process did not send a listening socket\n");
+    close(channel);
+    channel = -1;
+    return -1;
+  }
+  int sockfd;
+  memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+  return sockfd;
+}
+
+void acknowledge_handoff(void) {
+  if (channel < 0) return;
+  if (write(channel, "", 1) != 1)
+    perror("Failed to acknowledge handoff");
+  close(channel);
+  channel = -1;
+}
+
+bool hand_off_listener(const int sockfd, char *const argv[]) {
+  char path[PATH_MAX];
+  if (!find_executable(argv[0], path)) {
+    fprintf(stderr, "Could not find '%s' to restart\n", argv[0]);
+    return false;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("Failed to create handoff socket");
+    return false;
+  }
+  // fds[0] stays with us, fds[1] is inherited by the new process
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  char **env = make_environment(fds[1]);
+
+  pid_t child = fork();
+  if (child == 0) {
+    // only async-signal-safe functions are allowed before exec
+    execve(path, argv, env);
+    _exit(127);
+  }
+  free(env[0]);
+  free(env);
+  close(fds[1]);
+  if (child < 0) {
+    perror("Failed to fork new process");
+    close(fds[0]);
+    return false;
+  }
+
+  char dummy = 0;
+  struct iovec iov = {&dummy, 1};
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr message = {0};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buf;
+  message.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+  ssize_t sent;
+  while ((sent = sendmsg(fds[0], &message, 0)) < 0 && errno == EINTR) {}
+  if (sent < 0) {
+    perror("Failed to send listening socket");
+  } else if (wait_for_ack(fds[0])) {
+    close(fds[0]);
+    return true;
+  } else {
+    fprintf(stderr, "New process did not start in time, still serving\n");
+  }
+  close(fds[0]);
+  kill(child, SIGTERM);
+  while (waitpid(child, NULL, 0) < 0 && errno == EINTR) {}
+  return false;
+}
+
+/* Local routines */
+
+static long milliseconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Wait up to HANDOFF_TIMEOUT for the new process to acknowledge.
+// Signals (e.g. a trace flush) can arrive meanwhile, so retry on EINTR
+static bool wait_for_ack(const int fd) {
+  const long deadline = milliseconds() + HANDOFF_TIMEOUT;
+  struct pollfd ready = {fd, POLLIN, 0};
+  char dummy;
+  for (long left = HANDOFF_TIMEOUT; left > 0; left = deadline - milliseconds()) {
+    int n = poll(&ready, 1, (int)left);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    ssize_t got;
+    while ((got = read(fd, &dummy, 1)) < 0 && errno == EINTR) {}
+    return got == 1;
+  }
+  return false;
+}
+
+// Resolve `name` the same way the shell did when it started us.
+// The working directory never changes, so relative paths are still valid.
+static bool find_executable(const char *const name, char *path) {
+  if (strchr(name, '/') != NULL) {
+    snprintf(path, PATH_MAX, "%s", name);
+    return access(path, X_OK) == 0;
+  }
+  const char *dirs = getenv("PATH");
+  if (dirs == NULL) return false;
+  while (*dirs) {
+    size_t len = strcspn(dirs, ":");
+    snprintf(path, PATH_MAX, "%.*s/%s", (int)len, dirs, name);
+    if (access(path, X_OK) == 0) return true;
+    dirs += len;
+    if (*dirs == ':') dirs++;
+  }
+  return false;
+}
+
+// A copy of `environ` with HANDOFF_ENV set to `fd`.
+// Built before forking since setenv isn't safe to call after.
+static char **make_environment(const int fd) {
+  size_t n = 0;
+  while (environ[n] != NULL) n++;
+  char **env = malloc((n + 2) * sizeof(char *));
+  int len = snprintf(NULL, 0, "%s=%d", HANDOFF_ENV, fd);
+  env[0] = malloc(len + 1);
+  snprintf(env[0], len + 1, "%s=%d", HANDOFF_ENV, fd);
+  memcpy(env + 1, environ, (n + 1) * sizeof(char *));
+  return env;
+}
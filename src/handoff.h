@@ -0,0 +1,22 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include <stdbool.h>
+
+// milliseconds to wait for the new process to say it's ready
+#define HANDOFF_TIMEOUT 5000
+
+// If this process was started by `hand_off_listener`, receive the listening
+// socket from the old process. Returns -1 if there is no old process.
+int receive_listener(void);
+// Tell the old process we are ready to accept connections.
+// Does nothing if there is no old process.
+void acknowledge_handoff(void);
+// Start a new copy of this program and give it `sockfd` over a unix socket.
+// Returns true once the new process is accepting connections,
+// at which point the caller should stop accepting and exit.
+bool hand_off_listener(int sockfd, char *const argv[]);
+#endif  // HANDOFF_H
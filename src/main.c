@@ -8,6 +8,7 @@
 #define _DEFAULT_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <string.h>
 #include <stdio.h>
@@ -15,6 +16,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 // bsd doesn't include tcp with sys/socket
 #ifndef IPPROTO_TCP
@@ -30,38 +32,103 @@
 
 #include "response.h"
 #include "parse.h"
+#include "handoff.h"
+#include "bundle.h"
+#include "policy.h"
+#include "ratelimit.h"
+#include "sniff.h"
+#include "trace.h"
 
 // 2**16 - 1
 #define MAX_PORT 65535
 #define SOCKET_BUF_SIZE 8192
 // milliseconds
 #define TIMEOUT 5000
+// milliseconds to let in-flight connections finish after a hot restart
+#define DRAIN_TIMEOUT (2 * TIMEOUT)
+// how long a refused client gets to read its 429 before we close
+#define LINGER_TIMEOUT 1000
 
+// only the main loop closes this, -1 once it has
 static int sockfd;
-static volatile sig_atomic_t interrupted = 0;
+// self-pipe: signal handlers write a byte here to wake up the main loop
+static int wakeup[2];
+static volatile sig_atomic_t interrupted = 0, restart_requested = 0,
+                             flush_requested = 0;
+// number of connections with a running `respond` thread
+static int active_connections = 0;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_done = PTHREAD_COND_INITIALIZER;
 char current_dir[PATH_MAX];
 DICT mimetypes;
+// if set, every request is served from here instead of current_dir
+struct bundle *bundle = NULL;
 
+// sent as-is when a client is over its limits, before any other work
+static const char too_many_requests[] = "HTTP/1.1 429 Too Many Requests\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+struct connection {
+  int sock;
+  struct client *client;
+  uint64_t accepted;  // 0 if this connection isn't traced
+  bool over_limit;  // only send too_many_requests
+};
+
+static void usage(const char *);
 static void cleanup(int);
+static void request_restart(int);
+static void request_flush(int);
+static void wake_main_loop(void);
+static void spawn(void *(*)(void *), void *);
+static void drain_connections(void);
 static void *respond(void *);
+static void refuse(int);
 
 int main(int argc, char *argv[]) {
-  if (argc > 3 || (argc == 2 &&
-      (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))) {
-    fprintf(stderr, "usage: %s [<port>] [<host>]\n", argv[0]);
-    exit(1);
+  const char *bundle_file = NULL, *policy_file = NULL, *trace_prefix = NULL;
+  long rate = 0, max_connections = 0, trace_every = 0;
+  int opt;
+  if (argc > 1 && strcmp(argv[1], "--help") == 0) usage(argv[0]);
+  while ((opt = getopt(argc, argv, "hb:c:r:l:t:o:")) != -1) {
+    switch (opt) {
+      case 'b':
+        bundle_file = optarg;
+        break;
+      case 'c':
+        policy_file = optarg;
+        break;
+      case 'r':
+        rate = strtol(optarg, NULL, 0);
+        break;
+      case 'l':
+        max_connections = strtol(optarg, NULL, 0);
+        break;
+      case 't':
+        trace_every = strtol(optarg, NULL, 0);
+        break;
+      case 'o':
+        trace_prefix = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
   }
+  if (argc - optind > 2) usage(argv[0]);
   // by pure chance, strtol returns 0 if the entire string is invalid
   // since 0 is an invalid port anyway, we don't need to handle this specially
   // this does mean that strings starting with a valid port number then garbage
   // will be accepted
-  const long port = argc > 1 ? strtol(argv[1], NULL, 0) : 80;
+  const long port = argc > optind ? strtol(argv[optind], NULL, 0) : 80;
   if (port < 1 || port > MAX_PORT) {
     fprintf(stderr,
             "invalid port number: port must be between 1 and %d\n", MAX_PORT);
     exit(2);
   }
-  const char *const addr = argc > 2 ? argv[2] : "0.0.0.0";
+  const char *const addr = argc > optind + 1 ? argv[optind + 1] : "0.0.0.0";
 
   /* set current_dir */
   if (!getcwd(current_dir, PATH_MAX)) {
@@ -69,8 +136,25 @@ int main(int argc, char *argv[]) {
     exit(3);
   }
 
-  /* read mimetypes */
+  /* read mimetypes, and fall back to looking at the file */
   mimetypes = get_all_mimetypes();
+  sniff_init();
+
+  ratelimit_init(rate, max_connections);
+  if (!trace_init(trace_every > 0 ? trace_every : 0, trace_prefix,
+                  current_dir)) {
+    exit(14);
+  }
+
+  /* read cache policies, before the bundle so it can use them */
+  if (!load_cache_policies(policy_file)) {
+    exit(11);
+  }
+
+  /* map the bundle once, it's never unmapped */
+  if (bundle_file != NULL && (bundle = bundle_open(bundle_file)) == NULL) {
+    exit(10);
+  }
 
   /* initialize socket */
   struct sockaddr_in addrport;
@@ -81,10 +165,26 @@ int main(int argc, char *argv[]) {
     exit(4);
   }
 
-  sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (bind(sockfd, (struct sockaddr *) &addrport, sizeof(addrport)) != 0) {
-    perror("Failed to bind to socket, quitting");
-    exit(5);
+  /* if we're replacing an old process, it's already listening for us */
+  const bool inherited = (sockfd = receive_listener()) >= 0;
+  if (!inherited) {
+    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (bind(sockfd, (struct sockaddr *) &addrport, sizeof(addrport)) != 0) {
+      perror("Failed to bind to socket, quitting");
+      exit(5);
+    }
+  }
+  // don't leak the socket into anything we exec, it's passed explicitly
+  fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
+  /* let signal handlers interrupt the main loop */
+  if (pipe(wakeup) != 0) {
+    perror("Failed to create wakeup pipe, quitting");
+    exit(13);
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(wakeup[i], F_SETFD, FD_CLOEXEC);
+    fcntl(wakeup[i], F_SETFL, O_NONBLOCK);
   }
 
   /* register interrupt handler to close the socket */
@@ -107,72 +207,249 @@ int main(int argc, char *argv[]) {
     exit(7);
   }
 
+  /* hot restart on SIGUSR2 */
+  handler.sa_handler = &request_restart;
+  if (sigaction(SIGUSR2, &handler, NULL) != 0) {
+    perror("Failed to register SIGUSR2 handler, quitting");
+    exit(9);
+  }
+
+  /* write traces on SIGUSR1 */
+  handler.sa_handler = &request_flush;
+  if (sigaction(SIGUSR1, &handler, NULL) != 0) {
+    perror("Failed to register SIGUSR1 handler, quitting");
+    exit(12);
+  }
+
   /* open the socket */
-  if (listen(sockfd, 10) != 0) {
+  if (!inherited && listen(sockfd, 10) != 0) {
     perror("Failed to listen to socket, quitting");
     exit(8);
   }
+  acknowledge_handoff();
 
   /* main event loop.
-   * get responses out of the way ASAP so we can listen to more connections */
+   * get responses out of the way ASAP so we can listen to more connections.
+   * flags are checked every time around, so a signal is never left pending */
   while (!interrupted) {
-    int client_sock = accept(sockfd, NULL, NULL);
+    struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      perror("Failed to poll for connections, ignoring");
+    }
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(wakeup[0], buf, sizeof(buf)) > 0) {}
+    }
+    if (flush_requested) {
+      flush_requested = 0;
+      trace_flush();
+    }
+    if (restart_requested) {
+      restart_requested = 0;
+      if (hand_off_listener(sockfd, argv)) {
+        close(sockfd);
+        sockfd = -1;
+        interrupted = 1;
+        drain_connections();
+      }
+    }
+    if (interrupted || !(fds[0].revents & POLLIN)) continue;
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    struct client *client;
+    int client_sock = accept(sockfd, (struct sockaddr *) &peer, &peer_len);
     // branches are expensive,
     // but making a thread for a failed connection is more expensive
     // also, accept will reset perror, so this is only chance to find out
     // why we have an error
     if (client_sock < 0) {
-      if (!interrupted) perror("Failed to receive socket connection, ignoring");
+      if (!interrupted && errno != EINTR) {
+        perror("Failed to receive socket connection, ignoring");
+      }
     } else {
-      // TODO: actually keep track of which threads are active (:
-      pthread_t current;
-      pthread_create(&current, NULL, &respond, (void*)(long)client_sock);
-      pthread_detach(current);
+      // only this thread forks, so there's no race with hand_off_listener
+      fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+      pthread_mutex_lock(&connections_lock);
+      active_connections++;
+      pthread_mutex_unlock(&connections_lock);
+      struct connection *conn = malloc(sizeof(struct connection));
+      conn->sock = client_sock;
+      // refusing lingers, so that happens on its own thread too
+      conn->over_limit = !ratelimit_connect(peer.sin_addr.s_addr, &client);
+      conn->client = client;
+      conn->accepted = conn->over_limit ? 0 : trace_sample();
+      spawn(&respond, conn);
     }
   }
+  // stop accepting while the other threads finish up
+  if (sockfd >= 0) close(sockfd);
+  sockfd = -1;
+  trace_flush();
   pthread_exit(NULL);
 }
 
+// Start a detached thread. Signals are blocked in it,
+// so they're always handled by the main loop.
+static void spawn(void *(*start)(void *), void *arg) {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGUSR1);
+  sigaddset(&block, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  pthread_t thread;
+  pthread_create(&thread, NULL, start, arg);
+  pthread_detach(thread);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Wait for in-flight connections to finish, then exit.
+// Idle keep-alive connections close on their own after TIMEOUT.
+static void drain_connections(void) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += DRAIN_TIMEOUT / 1000;
+  deadline.tv_nsec += (DRAIN_TIMEOUT % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&connections_lock);
+  while (active_connections > 0
+         && pthread_cond_timedwait(&connections_done, &connections_lock,
+                                   &deadline) != ETIMEDOUT) {}
+  if (active_connections > 0)
+    fprintf(stderr, "Dropping %d connections after restart\n",
+            active_connections);
+  pthread_mutex_unlock(&connections_lock);
+  trace_flush();
+  exit(0);
+}
+
+static void usage(const char *const program) {
+  fprintf(stderr, "usage: %s [-b <bundle>] [-c <cache policy>] "
+          "[-r <requests/sec per client>] [-l <connections per client>] "
+          "[-t <trace 1 in N connections>] [-o <trace prefix>] "
+          "[<port>] [<host>]\n", program);
+  exit(1);
+}
+
 void *respond(void *arg) {
-  int client_sock = (long)arg;
+  struct connection *conn = arg;
+  int client_sock = conn->sock;
   char BUF[SOCKET_BUF_SIZE];
   struct pollfd fds = {client_sock, POLLIN, 0};
+  trace_thread_start(conn->accepted);
+
+  while (!conn->over_limit) {
+    uint64_t t = trace_begin();
+    int ready = poll(&fds, 1, TIMEOUT);
+    trace_end("poll", t);
+    if (ready <= 0) break;
 
-  while (poll(&fds, 1, TIMEOUT) > 0) {
     // fails miserably if the socket doesn't contain an entire HTTP request
+    t = trace_begin();
     ssize_t received = recv(client_sock, &BUF[0], SOCKET_BUF_SIZE, 0);
+    trace_end("recv", t);
     if (received < 0) {
       perror("Receive failed");
       break;
     } else if (received == 0) {  // connection closed
       break;
     }
+    if (!ratelimit_request(conn->client)) {
+      conn->over_limit = true;
+      break;
+    }
+    t = trace_begin();
     struct response result = handle_request(BUF);
+    trace_end("handle_request", t);
+    t = trace_begin();
     if (send(client_sock, result.status, strlen(result.status), 0) < 0
         || send(client_sock, result.headers, strlen(result.headers), 0) < 0
         || send(client_sock, result.body, result.length, 0) < 0) {
       if (errno != EPIPE) perror("Failed to send data through socket");
     }
+    trace_end("send", t);
     free(result.status);
     free(result.headers);
     if (result.is_mmapped)
         munmap(result.body, result.length);
-    else
+    else if (!result.is_borrowed)
         free(result.body);
 
     if (interrupted || !result.persist_connection) break;
   }
 
+  if (conn->over_limit) refuse(client_sock);
   close(client_sock);
+  ratelimit_disconnect(conn->client);
+  free(conn);
+  trace_thread_end();
+  pthread_mutex_lock(&connections_lock);
+  if (--active_connections == 0) pthread_cond_signal(&connections_done);
+  pthread_mutex_unlock(&connections_lock);
   return NULL;
 }
 
+// Send a 429 and close gracefully. Closing with unread data sends a RST,
+// which can discard the response before the client reads it, so stop
+// writing and read until the client hangs up, for at most LINGER_TIMEOUT
+static void refuse(const int client_sock) {
+  // small enough to fit in the socket buffer, so this won't block
+  send(client_sock, too_many_requests, sizeof(too_many_requests) - 1, 0);
+  shutdown(client_sock, SHUT_WR);
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long remaining = LINGER_TIMEOUT;
+  char BUF[SOCKET_BUF_SIZE];
+  struct pollfd fds = {client_sock, POLLIN, 0};
+  while (remaining > 0 && poll(&fds, 1, remaining) > 0
+         && recv(client_sock, BUF, SOCKET_BUF_SIZE, 0) > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = LINGER_TIMEOUT - (now.tv_sec - start.tv_sec) * 1000
+                - (now.tv_nsec - start.tv_nsec) / 1000000;
+  }
+}
+
 // we can't pass arguments to interrupt handlers, this ignored argument
 // is which signal we got
 void cleanup(int _) {
-  close(sockfd);
-  interrupted = 1;
   // cout is not interrupt safe
+  if (interrupted) {
+    // already shutting down or draining after a restart, stop waiting
+    const char message[] = "Interrupted again: exiting now\n";
+    write(STDERR_FILENO, message, sizeof(message));
+    _exit(0);
+  }
+  // the main loop closes the socket: the fd could be reused
+  // by another thread by the time the handler runs
+  interrupted = 1;
+  wake_main_loop();
   const char message[] = "Interrupted: preventing further connections\n";
   write(STDERR_FILENO, message, sizeof(message));
 }
+
+// the main loop does the actual work, since almost nothing is signal-safe
+void request_restart(int signum) {
+  (void)signum;
+  restart_requested = 1;
+  wake_main_loop();
+}
+
+void request_flush(int signum) {
+  (void)signum;
+  flush_requested = 1;
+  wake_main_loop();
+}
+
+// must be async-signal-safe
+static void wake_main_loop(void) {
+  const int saved = errno;
+  write(wakeup[1], "", 1);
+  errno = saved;
+}
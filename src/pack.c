@@ -0,0 +1,233 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Bundle builder. Packs a directory into a single file for `main -b`.
+ */
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "parse.h"
+#include "str.h"
+#include "sniff.h"
+
+#define MAX_DATE 60
+// file descriptors nftw is allowed to keep open
+#define MAX_OPEN_DIRS 20
+
+DICT mimetypes;
+
+struct packed {
+  char *path;  // what clients request
+  struct bundle_entry entry;
+};
+
+// nftw doesn't take a context argument
+static char *root;
+static size_t root_len;
+static char **files;
+static size_t num_files;
+
+static int collect(const char *, const struct stat *, int, struct FTW *);
+static int compare_paths(const void *, const void *);
+static struct bundle_blob write_string(FILE *, const char *);
+static struct bundle_blob write_body(FILE *, const char *filename,
+                                     const struct stat *, uint64_t *etag,
+                                     const char **mimetype);
+static char *make_headers(const char *mimetype, const struct stat *,
+                          uint64_t etag, long length, const char *extra);
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <directory> <bundle>\n", argv[0]);
+    exit(1);
+  }
+  root = strdup(argv[1]);
+  root_len = strlen(root);
+  while (root_len > 1 && root[root_len - 1] == '/') root[--root_len] = '\0';
+  mimetypes = get_all_mimetypes();
+  sniff_init();
+
+  if (nftw(root, &collect, MAX_OPEN_DIRS, FTW_PHYS) != 0) {
+    perror("Could not read directory");
+    exit(2);
+  }
+
+  FILE *out = fopen(argv[2], "wb");
+  if (out == NULL) {
+    perror("Could not open bundle for writing");
+    exit(3);
+  }
+  struct bundle_header header = {BUNDLE_MAGIC, BUNDLE_VERSION, 0, 0};
+  fwrite(&header, sizeof(header), 1, out);
+
+  // every file, plus up to two names for each directory index
+  struct packed *entries = malloc(3 * num_files * sizeof(struct packed));
+  size_t count = 0;
+  for (size_t i = 0; i < num_files; i++) {
+    const char *path = files[i] + root_len;
+    struct str *gzip_name = str_init();
+    str_append(gzip_name, "%s.gz", files[i]);
+    struct stat stat_info, gzip_info;
+    if (stat(files[i], &stat_info) != 0) {
+      perror(files[i]);
+      exit(4);
+    }
+    const bool has_gzip = stat(gzip_name->buf, &gzip_info) == 0
+                          && S_ISREG(gzip_info.st_mode);
+    const char *mimetype = get_mimetype(path);
+
+    struct bundle_entry *e = &entries[count].entry;
+    entries[count++].path = strdup(path);
+    e->path = e->file = write_string(out, path);
+
+    uint64_t etag, gzip_etag = 0;
+    e->body = write_body(out, files[i], &stat_info, &etag, &mimetype);
+    if (mimetype == NULL) mimetype = "";
+    e->mimetype = write_string(out, mimetype);
+    if (has_gzip) {
+      e->gzip_body = write_body(out, gzip_name->buf, &gzip_info, &gzip_etag,
+                                NULL);
+    } else {
+      e->gzip_body.offset = e->gzip_body.length = 0;
+    }
+
+    char *headers = make_headers(mimetype, &stat_info, etag,
+                                 e->body.length,
+                                 has_gzip ? "Vary: Accept-Encoding\r\n" : "");
+    e->headers = write_string(out, headers);
+    free(headers);
+    headers = has_gzip ? make_headers(mimetype, &stat_info, gzip_etag,
+                                      e->gzip_body.length,
+                                      "Content-Encoding: gzip\r\n"
+                                      "Vary: Accept-Encoding\r\n")
+                       : strdup("");
+    e->gzip_headers = write_string(out, headers);
+    free(headers);
+    str_free(gzip_name);
+
+    // the server resolves directories to their index, so we have to too
+    const char *base = strrchr(path, '/');
+    if (strcmp(base + 1, "index.html") == 0) {
+      struct str *dir = str_init();
+      str_append(dir, "%.*s", (int)(base - path), path);
+      if (dir->len > 0) {
+        entries[count].path = strdup(dir->buf);
+        entries[count].entry = *e;
+        entries[count++].entry.path = write_string(out, dir->buf);
+      }
+      str_append(dir, "/");
+      entries[count].path = strdup(dir->buf);
+      entries[count].entry = *e;
+      entries[count++].entry.path = write_string(out, dir->buf);
+      str_free(dir);
+    }
+    free(files[i]);
+  }
+  free(files);
+
+  qsort(entries, count, sizeof(struct packed), &compare_paths);
+  long pos = ftell(out);
+  long padding = (sizeof(uint64_t) - pos % sizeof(uint64_t)) % sizeof(uint64_t);
+  fwrite("\0\0\0\0\0\0\0", 1, padding, out);
+  header.index = pos + padding;
+  header.count = count;
+  for (size_t i = 0; i < count; i++) {
+    fwrite(&entries[i].entry, sizeof(struct bundle_entry), 1, out);
+    free(entries[i].path);
+  }
+  free(entries);
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out);
+  if (fclose(out) != 0) {
+    perror("Could not write bundle");
+    exit(5);
+  }
+  free(root);
+  printf("packed %zu paths\n", count);
+  return 0;
+}
+
+/* Local routines */
+
+static int collect(const char *filename, const struct stat *stat_info,
+                   int type, struct FTW *ftw) {
+  (void)ftw;
+  if (type != FTW_F || !S_ISREG(stat_info->st_mode)) return 0;
+  files = realloc(files, (num_files + 1) * sizeof(char *));
+  files[num_files++] = strdup(filename);
+  return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(((const struct packed *)a)->path,
+                ((const struct packed *)b)->path);
+}
+
+static struct bundle_blob write_string(FILE *out, const char *s) {
+  struct bundle_blob blob = {ftell(out), strlen(s)};
+  fwrite(s, 1, blob.length + 1, out);
+  return blob;
+}
+
+// page aligned, so the server could map individual files if it ever wants to.
+// if `*mimetype` is NULL, it's set by looking at the contents
+static struct bundle_blob write_body(FILE *out, const char *filename,
+                                     const struct stat *stat_info,
+                                     uint64_t *etag, const char **mimetype) {
+  static const char zeroes[BUNDLE_ALIGN];
+  long pos = ftell(out);
+  fwrite(zeroes, 1, (BUNDLE_ALIGN - pos % BUNDLE_ALIGN) % BUNDLE_ALIGN, out);
+  struct bundle_blob blob = {ftell(out), stat_info->st_size};
+
+  // FNV-1a, so the ETag changes exactly when the contents do
+  *etag = 14695981039346656037ULL;
+  if (blob.length == 0) return blob;
+  int fd = open(filename, O_RDONLY);
+  const unsigned char *data = fd == -1 ? MAP_FAILED
+      : mmap(NULL, blob.length, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    perror(filename);
+    exit(4);
+  }
+  close(fd);
+  for (uint64_t i = 0; i < blob.length; i++) {
+    *etag = (*etag ^ data[i]) * 1099511628211ULL;
+  }
+  if (mimetype != NULL && *mimetype == NULL) {
+    *mimetype = sniff_mimetype(stat_info, (const char *)data, blob.length);
+  }
+  fwrite(data, 1, blob.length, out);
+  munmap((void *)data, blob.length);
+  return blob;
+}
+
+static char *make_headers(const char *mimetype, const struct stat *stat_info,
+                          uint64_t etag, long length, const char *extra) {
+  struct str *headers = str_init();
+  if (*mimetype) str_append(headers, "Content-Type: %s\r\n", mimetype);
+  str_append(headers, "Content-Length: %ld\r\n", length);
+  // same format as the server uses for files outside a bundle
+  char date[MAX_DATE];
+  struct tm utc, *modified = gmtime_r(&stat_info->st_mtime, &utc);
+  if (modified != NULL) {
+    strftime(date, MAX_DATE, "%a, %d %b %Y %H:%M:%S GMT", modified);
+    str_append(headers, "Last-Modified: %s\r\n", date);
+  }
+  str_append(headers, "ETag: \"%016llx\"\r\n%s",
+             (unsigned long long)etag, extra);
+  char *buf = headers->buf;
+  free(headers);  // doesn't free the buf
+  return buf;
+}
@@ -7,6 +7,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -33,7 +34,7 @@ DICT get_all_mimetypes(void) {
 
   if ((mime_database = fopen("mime.types", "r")) == NULL
       && (mime_database = fopen("/etc/mime.types", "r")) == NULL)
-      // empty database, we'll look files up with libmagic at runtime
+      // empty database, files will be looked up with libmagic (see sniff.c)
       return result;
 
   char *line = NULL;
@@ -97,13 +98,58 @@ int process_headers(const char *request, DICT headers) {
   char header[MAX_HEADER+1], body[MAX_HEADER_BODY+1];
   int read, ret = 0;
 
-  // for every line
+  // for every line. values can contain spaces, e.g. `Accept-Encoding: a, b`
   while ((sscanf(request, "%" str(MAX_HEADER) "[^ \t\r\n:]: %"
-                          str(MAX_HEADER_BODY) "s\r\n%n",
+                          str(MAX_HEADER_BODY) "[^\r\n]\r\n%n",
                  header, body, &read)) == 2) {
+    size_t len = strlen(body);
+    while (len > 0 && isspace((unsigned char)body[len - 1])) body[--len] = '\0';
     dict_put(headers, strdup(header), strdup(body));
     ret += read;
     request += read;
   }
   return ret;
 }
+
+// Whether an Accept-Encoding header value allows `coding`, e.g.
+// `deflate, gzip;q=0.5` allows gzip but `gzip;q=0, *` does not.
+// Codings are case-insensitive and named ones take priority over `*`;
+// `x-gzip` is treated the same as `gzip` (RFC 7230 section 4.2.3).
+bool accepts_encoding(const char *header, const char *const coding) {
+  const size_t coding_len = strlen(coding);
+  const bool is_gzip = strcasecmp(coding, "gzip") == 0;
+  int named = -1, wildcard = -1;
+  if (header == NULL) return false;
+  while (*header) {
+    header += strspn(header, " \t,");
+    const size_t name_len = strcspn(header, " \t;,");
+    if (name_len == 0) {
+      header += strcspn(header, ",");
+      continue;
+    }
+    const char *name = header;
+    header += name_len;
+
+    // only `q` is defined, but skip anything else
+    bool acceptable = true;
+    const char *end = header + strcspn(header, ",");
+    for (const char *param = header; param < end; param++) {
+      if (*param != ';') continue;
+      param += strspn(param + 1, " \t") + 1;
+      if ((*param == 'q' || *param == 'Q') && param[1] == '=') {
+        acceptable = strtod(param + 2, NULL) > 0;
+      }
+    }
+    header = end;
+
+    if (name_len == 1 && *name == '*') {
+      wildcard = acceptable;
+    } else if ((name_len == coding_len
+                && strncasecmp(name, coding, coding_len) == 0)
+               || (is_gzip && name_len == strlen("x-gzip")
+                   && strncasecmp(name, "x-gzip", name_len) == 0)) {
+      named = named == 1 || acceptable;
+    }
+  }
+  return named != -1 ? named : wildcard == 1;
+}
@@ -4,6 +4,7 @@
  */
 #ifndef PARSE_H
 #define PARSE_H
+#include <stdbool.h>
 #include "dict.h"
 
 #define MAX_MIMETYPE 1000
@@ -28,4 +29,5 @@ DICT get_all_mimetypes(void);
 int process_request_line(const char*, struct request_info *);
 int process_headers(const char*, DICT headers);
 const char *get_mimetype(const char *);
+bool accepts_encoding(const char *header, const char *coding);
 #endif  // PARSE_H
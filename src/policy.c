@@ -0,0 +1,162 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Cache policies. Decides the Cache-Control and Expires headers for a file.
+ *
+ * Each line of the policy file is `<kind> <pattern> <Cache-Control value>`:
+ *   prefix /static/  public, max-age=31536000, immutable
+ *   ext    css       public, max-age=3600
+ *   type   text/html no-cache
+ *   default          private, max-age=60
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+#include "parse.h"
+
+#define WHITESPACE " \t\r\n"
+
+struct rule {
+  char *pattern;
+  size_t length;
+  struct cache_policy policy;
+};
+
+struct rules {
+  struct rule *list;
+  size_t count;
+};
+
+static struct rules prefixes, extensions, types;
+static struct cache_policy default_policy;
+static bool has_default = false;
+
+static struct cache_policy make_policy(const char *cache_control);
+static void add_rule(struct rules *, const char *pattern, const char *value);
+static int longest_first(const void *, const void *);
+static int by_pattern(const void *, const void *);
+static const struct cache_policy *find(const struct rules *, const char *key);
+
+bool load_cache_policies(const char *filename) {
+  FILE *file = fopen(filename == NULL ? DEFAULT_POLICY_FILE : filename, "r");
+  if (file == NULL) {
+    if (filename == NULL) return true;
+    perror("Could not open cache policy file");
+    return false;
+  }
+
+  char *line = NULL;
+  size_t n = 0;
+  for (int lineno = 1; getline(&line, &n, file) > 0; lineno++) {
+    char *kind = strtok(line, WHITESPACE), *pattern = NULL, *value;
+    if (kind == NULL || kind[0] == '#') continue;
+    if (strcmp(kind, "default") != 0) pattern = strtok(NULL, WHITESPACE);
+    value = strtok(NULL, "\r\n");
+    if (value != NULL) value += strspn(value, WHITESPACE);
+    if ((pattern == NULL && strcmp(kind, "default") != 0)
+        || value == NULL || *value == '\0') {
+      fprintf(stderr, "cache policy line %d: expected "
+              "'<kind> <pattern> <Cache-Control>', ignoring\n", lineno);
+      continue;
+    }
+
+    if (strcmp(kind, "prefix") == 0) {
+      add_rule(&prefixes, pattern, value);
+    } else if (strcmp(kind, "ext") == 0) {
+      // allow both `css` and `.css`
+      add_rule(&extensions, pattern + (pattern[0] == '.'), value);
+    } else if (strcmp(kind, "type") == 0) {
+      add_rule(&types, pattern, value);
+    } else if (strcmp(kind, "default") == 0) {
+      if (has_default) free(default_policy.cache_control);
+      default_policy = make_policy(value);
+      has_default = true;
+    } else {
+      fprintf(stderr, "cache policy line %d: unknown kind '%s', ignoring\n",
+              lineno, kind);
+    }
+  }
+  free(line);
+  fclose(file);
+
+  // compile: prefixes are tried in order, the rest are binary searched
+  qsort(prefixes.list, prefixes.count, sizeof(struct rule), &longest_first);
+  qsort(extensions.list, extensions.count, sizeof(struct rule), &by_pattern);
+  qsort(types.list, types.count, sizeof(struct rule), &by_pattern);
+  return true;
+}
+
+const struct cache_policy *get_cache_policy(const char *const url,
+                                            const char *const filename,
+                                            const char *const mimetype) {
+  for (size_t i = 0; i < prefixes.count; i++) {
+    if (strncmp(url, prefixes.list[i].pattern, prefixes.list[i].length) == 0)
+      return &prefixes.list[i].policy;
+  }
+  // `/` and `/index.html` are the same file, so they get the same policy
+  const char *base = strrchr(filename, '/'), *ext;
+  const struct cache_policy *policy;
+  if ((ext = strrchr(base == NULL ? filename : base, '.')) != NULL
+      && (policy = find(&extensions, ext + 1)) != NULL)
+    return policy;
+  if (mimetype != NULL) {
+    // ignore parameters like `; charset=utf-8`
+    char type[MAX_MIMETYPE + 1];
+    snprintf(type, sizeof(type), "%.*s", (int)strcspn(mimetype, ";"), mimetype);
+    if ((policy = find(&types, type)) != NULL) return policy;
+  }
+  return has_default ? &default_policy : NULL;
+}
+
+/* Local routines */
+
+static struct cache_policy make_policy(const char *const cache_control) {
+  struct cache_policy policy = {-1, strdup(cache_control)};
+  const char *max_age = strstr(cache_control, "max-age=");
+  if (max_age != NULL) {
+    policy.max_age = strtol(max_age + strlen("max-age="), NULL, 10);
+  }
+  return policy;
+}
+
+// later lines override earlier ones with the same pattern
+static void add_rule(struct rules *rules, const char *const pattern,
+                     const char *const value) {
+  for (size_t i = 0; i < rules->count; i++) {
+    if (strcmp(rules->list[i].pattern, pattern) == 0) {
+      free(rules->list[i].policy.cache_control);
+      rules->list[i].policy = make_policy(value);
+      return;
+    }
+  }
+  rules->list = realloc(rules->list, (rules->count + 1) * sizeof(struct rule));
+  struct rule *rule = &rules->list[rules->count++];
+  rule->pattern = strdup(pattern);
+  rule->length = strlen(pattern);
+  rule->policy = make_policy(value);
+}
+
+static int longest_first(const void *a, const void *b) {
+  size_t x = ((const struct rule *)a)->length,
+         y = ((const struct rule *)b)->length;
+  return (x < y) - (x > y);
+}
+
+static int by_pattern(const void *a, const void *b) {
+  return strcmp(((const struct rule *)a)->pattern,
+                ((const struct rule *)b)->pattern);
+}
+
+static const struct cache_policy *find(const struct rules *rules,
+                                       const char *const key) {
+  if (rules->count == 0) return NULL;
+  const struct rule needle = {(char *)key, 0, {0, NULL}};
+  const struct rule *rule = bsearch(&needle, rules->list, rules->count,
+                                    sizeof(struct rule), &by_pattern);
+  return rule == NULL ? NULL : &rule->policy;
+}
@@ -0,0 +1,27 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef POLICY_H
+#define POLICY_H
+#include <stdbool.h>
+
+#define DEFAULT_POLICY_FILE "cache.policy"
+
+struct cache_policy {
+  long max_age;  // seconds, -1 if Cache-Control has no max-age
+  char *cache_control;  // the value of the header
+};
+
+// Read the policy table. If `filename` is NULL, DEFAULT_POLICY_FILE is
+// used if it exists. Returns false if `filename` couldn't be read.
+// NOTE: not thread-safe, only call at startup
+bool load_cache_policies(const char *filename);
+// The policy for a canonical url, the file it resolved to and its mimetype
+// (which may be NULL). Longest matching prefix of the url wins,
+// then extension of the file, then mimetype, then default.
+// Returns NULL if nothing matches.
+const struct cache_policy *get_cache_policy(const char *url,
+                                            const char *filename,
+                                            const char *mimetype);
+#endif  // POLICY_H
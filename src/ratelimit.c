@@ -0,0 +1,148 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Rate limiting. Token buckets per client IP, kept in a fixed size table
+ * that's only ever touched with atomics.
+ *
+ * The table is split into shards by address; within a shard a client can
+ * be in any of the slots, and new clients replace the one seen least
+ * recently. Limits are approximate: two threads adding the same new client
+ * at once may give it two slots, and a slot can be reused right as its old
+ * client reconnects. Neither matters for keeping one client from hogging
+ * the server.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+// tokens are stored in thousandths so refilling every millisecond is exact:
+// `rate` requests per second is `rate` millitokens per millisecond
+#define TOKEN 1000
+// buckets hold at most UINT32_MAX millitokens
+#define MAX_RATE (UINT32_MAX / TOKEN)
+// a slot that's been claimed by another thread, give up after this many
+#define MAX_CLAIM_ATTEMPTS 3
+
+struct client {
+  // the address plus 1 << 32, so that 0 means the slot is empty.
+  // aligned so that every slot has its own cache line
+  _Alignas(64) _Atomic uint64_t key;
+  // millitokens in the high half, time of the last refill in the low half
+  _Atomic uint64_t bucket;
+  _Atomic uint32_t last_seen;
+  atomic_int connections;
+};
+
+static struct client table[RATELIMIT_SHARDS * RATELIMIT_WAYS];
+static uint32_t rate = 0, capacity = 0;
+static int max_connections = 0;
+
+static uint32_t now(void);
+static struct client *find_or_claim(uint64_t key);
+
+void ratelimit_init(const long requests_per_second, const long connections) {
+  if (requests_per_second > 0) {
+    rate = requests_per_second > MAX_RATE ? MAX_RATE : requests_per_second;
+    capacity = rate * TOKEN;
+  }
+  max_connections = connections > 0 ? connections : 0;
+}
+
+bool ratelimit_connect(const uint32_t addr, struct client **client) {
+  *client = NULL;
+  if (rate == 0 && max_connections == 0) return true;
+  // the table is full of clients with open connections, let this one through
+  if ((*client = find_or_claim(addr | (1ULL << 32))) == NULL) return true;
+
+  int open = atomic_fetch_add(&(*client)->connections, 1);
+  if (max_connections != 0 && open >= max_connections) {
+    atomic_fetch_sub(&(*client)->connections, 1);
+    *client = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool ratelimit_request(struct client *client) {
+  if (client == NULL || rate == 0) return true;
+  const uint32_t current = now();
+  atomic_store_explicit(&client->last_seen, current, memory_order_relaxed);
+
+  uint64_t old = atomic_load(&client->bucket), new;
+  do {
+    // another thread may have refilled after we read the clock
+    uint32_t last = (uint32_t)old,
+             elapsed = (int32_t)(current - last) > 0 ? current - last : 0;
+    uint64_t tokens = (old >> 32) + (uint64_t)elapsed * rate;
+    if (tokens > capacity) tokens = capacity;
+    if (tokens < TOKEN) return false;
+    new = (tokens - TOKEN) << 32 | (elapsed ? current : last);
+  } while (!atomic_compare_exchange_weak(&client->bucket, &old, new));
+  return true;
+}
+
+void ratelimit_disconnect(struct client *client) {
+  if (client != NULL) atomic_fetch_sub(&client->connections, 1);
+}
+
+/* Local routines */
+
+// milliseconds, wraps around every 49 days which is fine for differences
+static uint32_t now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint32_t)(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+}
+
+static inline unsigned shard(uint64_t key) {
+  // fibonacci hashing, addresses in the same subnet land in different shards
+  return (unsigned)((key * 11400714819323198485ULL) >> 58) % RATELIMIT_SHARDS;
+}
+
+static struct client *find_or_claim(const uint64_t key) {
+  struct client *slots = table + shard(key) * RATELIMIT_WAYS;
+  const uint32_t current = now();
+
+  for (int attempt = 0; attempt < MAX_CLAIM_ATTEMPTS; attempt++) {
+    struct client *victim = NULL;
+    uint64_t victim_key = 0;
+    uint32_t oldest = 0;
+    for (int i = 0; i < RATELIMIT_WAYS; i++) {
+      uint64_t k = atomic_load(&slots[i].key);
+      if (k == key) {
+        atomic_store_explicit(&slots[i].last_seen, current,
+                              memory_order_relaxed);
+        return slots + i;
+      }
+      const bool have_empty = victim != NULL && victim_key == 0;
+      if (k == 0) {
+        if (!have_empty) {
+          victim = slots + i;
+          victim_key = 0;
+        }
+        continue;
+      }
+      // least recently seen, but never evict a client that's connected
+      uint32_t age = current - atomic_load(&slots[i].last_seen);
+      if (!have_empty && atomic_load(&slots[i].connections) == 0
+          && (victim == NULL || age > oldest)) {
+        victim = slots + i;
+        victim_key = k;
+        oldest = age;
+      }
+    }
+    if (victim == NULL) return NULL;
+    if (atomic_compare_exchange_strong(&victim->key, &victim_key, key)) {
+      // a new client starts with a full bucket
+      atomic_store(&victim->bucket, (uint64_t)capacity << 32 | current);
+      atomic_store(&victim->last_seen, current);
+      return victim;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,28 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// the table never grows: clients beyond this share slots with the
+// least recently seen ones
+#define RATELIMIT_SHARDS 64
+#define RATELIMIT_WAYS 16
+
+struct client;
+
+// `rate` is requests per second (bursts of up to `rate` are allowed),
+// `max_connections` is open connections per client. 0 means unlimited.
+// NOTE: not thread-safe, only call at startup
+void ratelimit_init(long rate, long max_connections);
+// Returns false if `addr` (in network byte order) already has too many
+// connections open. Otherwise `*client` must be passed to ratelimit_disconnect
+// later; it's NULL if this client isn't being limited.
+bool ratelimit_connect(uint32_t addr, struct client **client);
+// Returns false if the client has made too many requests recently
+bool ratelimit_request(struct client *);
+void ratelimit_disconnect(struct client *);
+#endif  // RATELIMIT_H
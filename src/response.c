@@ -23,14 +23,21 @@
 #include "parse.h"
 #include "dict.h"
 #include "str.h"
+#include "bundle.h"
+#include "url.h"
+#include "policy.h"
+#include "sniff.h"
+#include "trace.h"
 
 extern char current_dir[];
+extern struct bundle *bundle;
 
 struct internal_response {
   enum response_code code;
   int length;
-  bool is_mmapped;
+  bool is_mmapped, is_borrowed;
   char *body;  // NOT a string, might not be null terminated
+  const char *mimetype;  // NULL if unknown
   struct str *logger, *headers;
 };
 
@@ -74,7 +81,8 @@ static inline char *make_header_line(const enum response_code code) {
 }
 
 static inline char *add_date(const time_t t) {
-  struct tm *current_time = localtime(&t);
+  // HTTP dates are always in GMT, and gmtime's result is shared between threads
+  struct tm utc, *current_time = gmtime_r(&t, &utc);
   if (current_time == NULL) {
     perror("Failed to get current time");
     return NULL;
@@ -86,9 +94,12 @@ static inline char *add_date(const time_t t) {
   return date;
 }
 
-static void get_file(const char *const filename,
+static void get_file(const char *const filename, const struct stat *stat_info,
                      struct internal_response *info) {
-  int fd = open(filename, O_RDONLY);
+  // don't leak into a hot-restarted process if it forks while we have this open
+  uint64_t t = trace_begin();
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  trace_end("open", t);
   if (fd == -1) {
     // TODO: set up a semaphore and wait until we can open the file
     if (errno == EMFILE) {
@@ -106,7 +117,9 @@ static void get_file(const char *const filename,
   if (info->length == 0) {
       info->body = NULL;
   } else {
+      t = trace_begin();
       info->body = (char*)mmap(NULL, info->length, PROT_READ, MAP_SHARED, fd, 0);
+      trace_end("mmap", t);
       if (info->body == MAP_FAILED) {
         printf("file: %s, fd: %d\n", filename, fd);
         perror("Could not mmap file");
@@ -120,19 +133,70 @@ static void get_file(const char *const filename,
   close(fd);
   info->code = OK;
   info->is_mmapped = true;
-  const char *mimetype = get_mimetype(filename);
-  if (mimetype != NULL) {
-      str_append(info->headers, "Content-Type: %s\r\n", mimetype);
+  info->mimetype = get_mimetype(filename);
+  if (info->mimetype == NULL) {
+      t = trace_begin();
+      info->mimetype = sniff_mimetype(stat_info, info->body, info->length);
+      trace_end("sniff", t);
+  }
+  if (info->mimetype != NULL) {
+      str_append(info->headers, "Content-Type: %s\r\n", info->mimetype);
+  }
+}
+
+static void add_cache_headers(const struct cache_policy *policy,
+                              struct internal_response *result) {
+  if (policy == NULL) return;
+  str_append(result->headers, "Cache-Control: %s\r\n", policy->cache_control);
+  if (policy->max_age < 0) return;
+  char *date = add_date(time(NULL) + policy->max_age);
+  if (date != NULL) {
+      str_append(result->headers, "Expires: %s\r\n", date);
+      free(date);
+  }
+}
+
+// everything comes from the bundle mapping, there are no syscalls here
+static void handle_bundle_url(const struct request_info *info, DICT headers,
+                              struct internal_response *result) {
+  uint64_t t = trace_begin();
+  const struct bundle_entry *entry = bundle_find(bundle, info->url);
+  trace_end("bundle_find", t);
+  if (entry == NULL) {
+    result->code = NOT_FOUND;
+    return;
+  }
+  const char *encodings = dict_get(headers, "Accept-Encoding");
+  const bool gzip = entry->gzip_headers.length != 0
+                    && accepts_encoding(encodings, "gzip");
+  const struct bundle_blob body = gzip ? entry->gzip_body : entry->body;
+
+  result->code = OK;
+  str_append(result->headers, "%s",
+             bundle_data(bundle, gzip ? entry->gzip_headers : entry->headers));
+  add_cache_headers(bundle_policy(bundle, entry), result);
+  if (info->method == HEAD) {
+    result->body = NULL;
+    result->length = 0;
+  } else {
+    result->body = (char *)bundle_data(bundle, body);
+    result->length = body.length;
+    result->is_borrowed = true;
   }
 }
 
-static void handle_url(struct request_info *info,
+static void handle_url(struct request_info *info, DICT headers,
                 struct internal_response *result) {
+  if (bundle != NULL) {
+    handle_bundle_url(info, headers, result);
+    return;
+  }
   struct stat stat_info;
   int error;
   struct str *file = str_init();
   str_append(file, "%s%s", current_dir, info->url);
 
+  uint64_t t = trace_begin();
   if ((error = stat(file->buf, &stat_info)) == 0
       && S_ISDIR(stat_info.st_mode)) {
 
@@ -141,6 +205,7 @@ static void handle_url(struct request_info *info,
     str_append(file, "%s", index_page);
     error = stat(file->buf, &stat_info);
   }
+  trace_end("stat", t);
 
   if (error) {
       if (errno == ENOENT || errno == ENOTDIR) {
@@ -156,8 +221,7 @@ static void handle_url(struct request_info *info,
   }
 
   result->length = stat_info.st_size;
-  get_file(file->buf, result);
-  str_free(file);
+  get_file(file->buf, &stat_info, result);
   if (info->method == HEAD && result->code == OK) {
     munmap(result->body, result->length);
     result->body = NULL;
@@ -170,24 +234,34 @@ static void handle_url(struct request_info *info,
         str_append(result->headers, "Last-Modified: %s\r\n", date);
         free(date);
     }
+    add_cache_headers(get_cache_policy(info->url, file->buf, result->mimetype),
+                      result);
   }
+  str_free(file);
 }
 
 struct response handle_request(char *orig_request) {
   struct request_info line;
   struct internal_response result;
   DICT headers = dict_init();
+  uint64_t t = trace_begin();
   char *request = orig_request + process_request_line(orig_request, &line);
-  result.is_mmapped = false;
+  trace_end("parse", t);
+  result.is_mmapped = result.is_borrowed = false;
+  result.mimetype = NULL;
   result.headers = str_init(), result.logger = str_init();
 
   if (line.method == ERROR) {
     result.code = BAD_REQUEST;
   } else if (line.method == NOT_RECOGNIZED) {
     result.code = NOT_IMPLEMENTED;
+  } else if (!canonicalize_url(line.url)) {
+    result.code = BAD_REQUEST;
   } else {
+    t = trace_begin();
     process_headers(request, headers);
-    handle_url(&line, &result);
+    trace_end("parse_headers", t);
+    handle_url(&line, headers, &result);
   }
   if (result.code != OK) {
     const char *error = "An error occured while processing your request",
@@ -214,7 +288,9 @@ struct response handle_request(char *orig_request) {
   str_append(result.logger, "[%s] \"%s\" %d %d \"%s\"",
             date == NULL ? "-" : date, orig_request, result.code,
             result.length, user_agent == NULL ? "-" : user_agent);
+  t = trace_begin();
   puts(result.logger->buf);
+  trace_end("log", t);
   str_free(result.logger);
   dict_free(headers);
 
@@ -229,6 +305,7 @@ struct response handle_request(char *orig_request) {
     result.body,
     result.length,
     result.is_mmapped,
+    result.is_borrowed,
     strcmp(line.version, "HTTP/1.0") != 0
   };
   free(line.version);
@@ -13,6 +13,7 @@ struct response {
   char *body;  // NOT a string, may not be null terminated
   int length;
   bool is_mmapped;
+  bool is_borrowed;  // points into memory we don't own, don't free it
   bool persist_connection;
 };
 
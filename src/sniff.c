@@ -0,0 +1,103 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Content sniffing. Asks libmagic for the mimetype of files that
+ * don't have a known extension, and remembers the answer.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <magic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sniff.h"
+#include "dict.h"
+
+// libmagic only needs the start of a file, and this keeps it
+// from faulting in all of a large mapping
+#define SNIFF_BYTES 65536
+
+struct sniffed {
+  bool valid;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+  const char *mimetype;
+};
+
+static struct sniffed cache[SNIFF_CACHE_SIZE];
+static pthread_mutex_t locks[SNIFF_LOCKS];
+// magic_t isn't thread-safe. this also protects `interned`
+static pthread_mutex_t magic_lock = PTHREAD_MUTEX_INITIALIZER;
+static magic_t cookie = NULL;
+// every mimetype we've returned. cache entries get overwritten,
+// so they can't own their strings while another thread is using them
+static DICT interned;
+
+static const char *ask_libmagic(const char *data, size_t length);
+
+bool sniff_init(void) {
+  for (int i = 0; i < SNIFF_LOCKS; i++) pthread_mutex_init(&locks[i], NULL);
+  interned = dict_init();
+  if ((cookie = magic_open(MAGIC_MIME)) == NULL
+      || magic_load(cookie, NULL) != 0) {
+    fprintf(stderr, "Could not load libmagic database: %s\n",
+            cookie == NULL ? "out of memory" : magic_error(cookie));
+    if (cookie != NULL) magic_close(cookie);
+    cookie = NULL;
+    return false;
+  }
+  return true;
+}
+
+const char *sniff_mimetype(const struct stat *stat_info, const char *data,
+                           const size_t length) {
+  if (cookie == NULL || length == 0) return NULL;
+  const size_t index = (stat_info->st_ino * 31 + stat_info->st_dev)
+                       % SNIFF_CACHE_SIZE;
+  struct sniffed *entry = &cache[index];
+  pthread_mutex_t *lock = &locks[index % SNIFF_LOCKS];
+
+  pthread_mutex_lock(lock);
+  if (entry->valid && entry->ino == stat_info->st_ino
+      && entry->dev == stat_info->st_dev
+      && entry->mtime == stat_info->st_mtime
+      && entry->size == stat_info->st_size) {
+    const char *mimetype = entry->mimetype;
+    pthread_mutex_unlock(lock);
+    return mimetype;
+  }
+  pthread_mutex_unlock(lock);
+
+  // libmagic is slow, don't hold up other files while it runs
+  const char *mimetype = ask_libmagic(data, length);
+  pthread_mutex_lock(lock);
+  *entry = (struct sniffed){true, stat_info->st_dev, stat_info->st_ino,
+                            stat_info->st_mtime, stat_info->st_size, mimetype};
+  pthread_mutex_unlock(lock);
+  return mimetype;
+}
+
+/* Local routines */
+
+static const char *ask_libmagic(const char *data, const size_t length) {
+  pthread_mutex_lock(&magic_lock);
+  const char *result = magic_buffer(cookie, data,
+                                    length < SNIFF_BYTES ? length : SNIFF_BYTES),
+             *mimetype = NULL;
+  if (result == NULL) {
+    fprintf(stderr, "libmagic failed: %s\n", magic_error(cookie));
+  } else if ((mimetype = dict_get(interned, result)) == NULL) {
+    char *type = strdup(result), *charset = strstr(type, "; charset=binary");
+    // a charset only means something for text
+    if (charset != NULL) *charset = '\0';
+    dict_put(interned, strdup(result), type);
+    mimetype = type;
+  }
+  pthread_mutex_unlock(&magic_lock);
+  return mimetype;
+}
@@ -0,0 +1,24 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef SNIFF_H
+#define SNIFF_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// number of files whose type is remembered
+#define SNIFF_CACHE_SIZE 1024
+// number of locks protecting the cache
+#define SNIFF_LOCKS 64
+
+// Returns false if libmagic couldn't load its database,
+// in which case sniff_mimetype always returns NULL.
+// NOTE: not thread-safe, only call at startup
+bool sniff_init(void);
+// Guess the mimetype of a file from its contents. Each version of a file
+// (by device, inode, mtime and size) is only looked at once.
+// Returns NULL if unknown. The result is never freed.
+const char *sniff_mimetype(const struct stat *, const char *data, size_t length);
+#endif  // SNIFF_H
@@ -0,0 +1,173 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * Tracing. Records how long each phase of a sampled request takes, so slow
+ * requests can be opened as a timeline in chrome://tracing or Perfetto.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "str.h"
+
+struct span {
+  const char *name;
+  uint64_t begin, end;
+};
+
+struct trace_buffer {
+  unsigned id;  // shown as the thread id, one row per connection
+  unsigned count;
+  struct trace_buffer *next;
+  struct span spans[TRACE_EVENTS];
+};
+
+_Thread_local struct trace_buffer *trace_current = NULL;
+
+static unsigned sample_every = 0;
+static char output_prefix[PATH_MAX];
+// only touched by the accepting thread
+static unsigned connections_seen = 0;
+static atomic_uint next_id = 0;
+
+// finished buffers waiting to be written
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *pending = NULL;
+static unsigned num_pending = 0, dropped = 0, flushes = 0;
+
+bool trace_init(const unsigned sample, const char *prefix,
+                const char *const root) {
+  sample_every = sample;
+  if (sample == 0) return true;
+
+  char default_prefix[PATH_MAX];
+  if (prefix == NULL) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(default_prefix, PATH_MAX, "%s/trace",
+             tmp != NULL && tmp[0] == '/' ? tmp : "/tmp");
+    prefix = default_prefix;
+  }
+  if (prefix[0] != '/') {
+    fprintf(stderr, "Trace prefix '%s' must be an absolute path\n", prefix);
+    return false;
+  }
+  // resolve symlinks and `..` in the directory, the file doesn't exist yet
+  const char *base = strrchr(prefix, '/') + 1;
+  char dir[PATH_MAX];
+  snprintf(dir, PATH_MAX, "%.*s", (int)(base - prefix), prefix);
+  if (realpath(dir, output_prefix) == NULL) {
+    perror("Could not find trace directory");
+    return false;
+  }
+  // anything in the document root can be downloaded
+  const size_t root_len = strlen(root);
+  if (strcmp(root, "/") == 0 || (strncmp(output_prefix, root, root_len) == 0
+      && (output_prefix[root_len] == '/' || output_prefix[root_len] == '\0'))) {
+    fprintf(stderr, "Trace prefix '%s' is inside the served directory %s\n",
+            prefix, root);
+    return false;
+  }
+  size_t len = strlen(output_prefix);
+  snprintf(output_prefix + len, PATH_MAX - len, "/%s", base);
+  return true;
+}
+
+uint64_t trace_sample(void) {
+  if (sample_every == 0 || connections_seen++ % sample_every != 0) return 0;
+  return trace_now();
+}
+
+void trace_thread_start(const uint64_t accepted) {
+  if (accepted == 0) return;
+  trace_current = malloc(sizeof(struct trace_buffer));
+  trace_current->id = atomic_fetch_add(&next_id, 1);
+  trace_current->count = 0;
+  trace_record("spawn", accepted);
+}
+
+void trace_thread_end(void) {
+  struct trace_buffer *buffer = trace_current;
+  if (buffer == NULL) return;
+  trace_current = NULL;
+
+  pthread_mutex_lock(&pending_lock);
+  if (num_pending < TRACE_MAX_PENDING) {
+    buffer->next = pending;
+    pending = buffer;
+    num_pending++;
+    buffer = NULL;
+  } else {
+    dropped++;
+  }
+  pthread_mutex_unlock(&pending_lock);
+  free(buffer);
+}
+
+void trace_flush(void) {
+  pthread_mutex_lock(&pending_lock);
+  struct trace_buffer *buffers = pending;
+  unsigned lost = dropped, seq = flushes++;
+  pending = NULL;
+  num_pending = dropped = 0;
+  pthread_mutex_unlock(&pending_lock);
+  if (buffers == NULL) return;
+
+  struct str *filename = str_init();
+  str_append(filename, "%s-%ld-%u.json", output_prefix, (long)getpid(), seq);
+  FILE *out = fopen(filename->buf, "w");
+  if (out == NULL) perror("Could not write trace");
+  else if (lost != 0)
+    fprintf(stderr, "Trace buffer full, dropped %u connections\n", lost);
+
+  const long pid = getpid();
+  bool first = true;
+  if (out != NULL) fputs("{\"traceEvents\":[\n", out);
+  while (buffers != NULL) {
+    struct trace_buffer *buffer = buffers;
+    buffers = buffers->next;
+    if (out != NULL) {
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+              "\"tid\":%u,\"args\":{\"name\":\"connection %u\"}}",
+              first ? "" : ",\n", pid, buffer->id, buffer->id);
+      first = false;
+      for (unsigned i = 0; i < buffer->count; i++) {
+        const struct span *span = &buffer->spans[i];
+        // chrome wants microseconds
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u}",
+                span->name, span->begin / 1000.0,
+                (span->end - span->begin) / 1000.0, pid, buffer->id);
+      }
+    }
+    free(buffer);
+  }
+  if (out != NULL) {
+    fputs("\n]}\n", out);
+    fclose(out);
+    fprintf(stderr, "Wrote trace to %s\n", filename->buf);
+  }
+  str_free(filename);
+}
+
+uint64_t trace_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void trace_record(const char *const name, const uint64_t begin) {
+  struct trace_buffer *buffer = trace_current;
+  if (buffer == NULL || buffer->count == TRACE_EVENTS) return;
+  buffer->spans[buffer->count++] = (struct span){name, begin, trace_now()};
+}
@@ -0,0 +1,51 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// spans recorded per connection, later ones are dropped
+#define TRACE_EVENTS 512
+// connections kept waiting for trace_flush, later ones are dropped
+#define TRACE_MAX_PENDING 4096
+
+struct trace_buffer;
+// the buffer for the connection this thread is handling, NULL if not sampled
+extern _Thread_local struct trace_buffer *trace_current;
+
+// Trace 1 in `sample` connections, 0 turns tracing off.
+// Traces are written to `<prefix>-<pid>-<n>.json`, `prefix` defaults to
+// `$TMPDIR/trace` (or `/tmp/trace`) if it's NULL.
+// Returns false if `prefix` isn't absolute or is inside `root`,
+// the directory being served, where traces could be downloaded.
+// NOTE: not thread-safe, only call at startup
+bool trace_init(unsigned sample, const char *prefix, const char *root);
+// Called by the accepting thread for every connection.
+// Returns the current time if this connection should be traced, otherwise 0
+uint64_t trace_sample(void);
+// Called when a thread starts handling a connection.
+// `accepted` is what trace_sample returned
+void trace_thread_start(uint64_t accepted);
+// Called when a thread is done with its connection
+void trace_thread_end(void);
+// Write everything recorded since the last flush in Chrome trace format
+void trace_flush(void);
+
+// nanoseconds
+uint64_t trace_now(void);
+void trace_record(const char *name, uint64_t begin);
+
+// Usage: uint64_t t = trace_begin(); ...; trace_end("name", t);
+// These are as close to free as possible when the connection isn't sampled.
+static inline uint64_t trace_begin(void) {
+  return trace_current == NULL ? 0 : trace_now();
+}
+
+// `name` must be a string literal
+static inline void trace_end(const char *name, const uint64_t begin) {
+  if (begin != 0) trace_record(name, begin);
+}
+#endif  // TRACE_H
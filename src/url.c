@@ -0,0 +1,169 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ *
+ * URL canonicalization. Turns the path from the request line into
+ * something that's safe to append to current_dir and to use as a cache key.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "url.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HAVE_SSE2
+#include <immintrin.h>
+#endif
+// AVX2 isn't part of the x86-64 baseline, so check for it at runtime
+#if defined(HAVE_SSE2) && defined(__x86_64__)
+#define HAVE_AVX2
+#endif
+
+static size_t scan(const char *url, size_t len);
+static bool decode(char *url);
+static bool collapse(char *url);
+
+bool canonicalize_url(char *const url) {
+  if (url[0] != '/') return false;
+  size_t len = strlen(url);
+  // almost every url is already canonical, so check that as fast as we can
+  if (scan(url, len) == len) return true;
+  return decode(url) && collapse(url);
+}
+
+/* Local routines */
+
+// a byte that means the url might not be canonical:
+// '%', '?', '#', or a '.' or '/' right after a '/'
+static inline bool is_special(const char c, const char prev) {
+  return c == '%' || c == '?' || c == '#'
+         || (prev == '/' && (c == '.' || c == '/'));
+}
+
+static size_t scan_scalar(const char *const url, size_t i, const size_t len) {
+  for (; i < len; i++) {
+    if (is_special(url[i], i > 0 ? url[i - 1] : '\0')) return i;
+  }
+  return len;
+}
+
+#ifdef HAVE_SSE2
+// one bit per byte: which bytes are special, given which bytes are slashes.
+// `carry` is whether the byte before this chunk was a slash
+static inline unsigned special_mask(unsigned special, unsigned slash,
+                                    unsigned dot, unsigned carry) {
+  return special | ((dot | slash) & ((slash << 1) | carry));
+}
+
+static size_t scan_sse2(const char *const url, const size_t len) {
+  const __m128i percent = _mm_set1_epi8('%'), question = _mm_set1_epi8('?'),
+                hash = _mm_set1_epi8('#'), slash = _mm_set1_epi8('/'),
+                dot = _mm_set1_epi8('.');
+  unsigned carry = 0;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(url + i));
+    unsigned special = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, percent),
+                     _mm_cmpeq_epi8(chunk, question)),
+        _mm_cmpeq_epi8(chunk, hash)));
+    unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash));
+    unsigned dots = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dot));
+    unsigned found = special_mask(special, slashes, dots, carry) & 0xFFFF;
+    if (found) return i + __builtin_ctz(found);
+    carry = (slashes >> 15) & 1;
+  }
+  return scan_scalar(url, i, len);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *const url, const size_t len) {
+  const __m256i percent = _mm256_set1_epi8('%'),
+                question = _mm256_set1_epi8('?'),
+                hash = _mm256_set1_epi8('#'), slash = _mm256_set1_epi8('/'),
+                dot = _mm256_set1_epi8('.');
+  unsigned carry = 0;
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(url + i));
+    unsigned special = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent),
+                        _mm256_cmpeq_epi8(chunk, question)),
+        _mm256_cmpeq_epi8(chunk, hash)));
+    unsigned slashes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, slash));
+    unsigned dots = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, dot));
+    unsigned found = special_mask(special, slashes, dots, carry);
+    if (found) return i + __builtin_ctz(found);
+    carry = slashes >> 31;
+  }
+  return scan_scalar(url, i, len);
+}
+#endif
+
+// Returns the index of the first special byte, or `len` if there are none
+static size_t scan(const char *const url, const size_t len) {
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) return scan_avx2(url, len);
+#endif
+#ifdef HAVE_SSE2
+  return scan_sse2(url, len);
+#else
+  return scan_scalar(url, 0, len);
+#endif
+}
+
+static inline int hex_value(const char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// percent-decode up to the query or fragment. decoding never makes the
+// url longer, so this can be done in place
+static bool decode(char *const url) {
+  char *w = url;
+  for (const char *r = url; *r && *r != '?' && *r != '#'; r++) {
+    if (*r != '%') {
+      *w++ = *r;
+      continue;
+    }
+    int high = hex_value(r[1]), low = high < 0 ? -1 : hex_value(r[2]);
+    if (low < 0 || (high == 0 && low == 0)) return false;
+    *w++ = (char)(high << 4 | low);
+    r += 2;
+  }
+  *w = '\0';
+  return true;
+}
+
+// remove empty, '.' and '..' segments. `url` starts with '/'
+static bool collapse(char *const url) {
+  char *w = url + 1;
+  const char *r = url + 1;
+  // invariant: `w` is always right after a '/'
+  while (*r) {
+    if (*r == '/') {
+      r++;
+      continue;
+    }
+    const char *end = r + strcspn(r, "/");
+    const size_t n = end - r;
+    if (n == 1 && r[0] == '.') {
+      // nothing to do
+    } else if (n == 2 && r[0] == '.' && r[1] == '.') {
+      if (w == url + 1) return false;  // would escape the root
+      w--;
+      while (w[-1] != '/') w--;
+    } else {
+      memmove(w, r, n);
+      w += n;
+      if (*end == '/') *w++ = '/';
+    }
+    r = end;
+  }
+  *w = '\0';
+  return true;
+}
@@ -0,0 +1,14 @@
+/* Copyright 2019 Joshua Nelson
+ * This program is licensed under the BSD 3-Clause License.
+ * See LICENSE.txt or https://opensource.org/licenses/BSD-3-Clause for details.
+ */
+#ifndef URL_H
+#define URL_H
+#include <stdbool.h>
+
+// Canonicalize a request path in place: strip the query and fragment,
+// percent-decode, collapse duplicate slashes and dot segments.
+// The result always starts with '/' and never contains '..' segments.
+// Returns false if the url is malformed, contains NUL, or escapes the root.
+bool canonicalize_url(char *url);
+#endif  // URL_H
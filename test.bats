@@ -14,7 +14,7 @@ stderr () {
 
 curl () {
   URL=$1; shift
-  command curl -m 1 -s "$@" "localhost:$PORT/$URL"
+  command curl -m 1 -s "$@" "localhost:${SERVER_PORT:-$PORT}/$URL"
 }
 
 curl_status () {
@@ -27,6 +27,23 @@ content_size () {
   sed 's/Content-Length: //; s/\s//g' | tr -d '\r'
 }
 
+# for tests that need flags: starts a second server that `curl` talks to
+start_server () {
+  SERVER_PORT=$(( PORT + BATS_TEST_NUMBER ))
+  ./main "$@" "$SERVER_PORT" >/dev/null 2>&1 3>&- &
+  SERVER_PID=$!
+  sleep 0.5
+}
+
+teardown () {
+  if [ -n "$SERVER_PID" ]; then
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" || true
+    # whatever it handed the socket to after SIGUSR2
+    pkill -f "^\./main .*$SERVER_PORT\$" || true
+  fi
+}
+
 # tests
 
 @test "serves files" {
@@ -104,3 +121,130 @@ content_size () {
   touch blah
   [ "$(curl_status blah/)" -eq 404 ]
 }
+
+@test "Ignores query strings and fragments" {
+  echo hi > blah
+  [ "$(curl 'blah?version=2')" = "hi" ]
+}
+
+@test "Decodes percent escapes" {
+  echo hi > 'with space'
+  [ "$(curl with%20space)" = "hi" ]
+}
+
+@test "Collapses dot segments" {
+  mkdir -p subdir
+  echo hi > blah
+  [ "$(curl subdir/../blah --path-as-is)" = "hi" ]
+  [ "$(curl ./subdir/./../blah --path-as-is)" = "hi" ]
+}
+
+@test "Rejects paths outside the root" {
+  [ "$(curl_status ../../etc/passwd --path-as-is)" -eq 400 ]
+  [ "$(curl_status %2e%2e/%2e%2e/etc/passwd)" -eq 400 ]
+  [ "$(curl_status blah%00.html)" -eq 400 ]
+}
+
+@test "Sniffs Content-Type of files without an extension" {
+  echo hi > blah
+  curl /blah -I | grep -q "Content-Type: text/plain"
+  printf '\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\1\0\0\0\1\x08\x06\0\0\0' > picture
+  curl /picture -I | grep -q "Content-Type: image/png"
+}
+
+@test "Serves bundles" {
+  mkdir -p site/sub
+  echo hi > site/index.html
+  echo sub > site/sub/index.html
+  echo 'body {}' > site/style.css
+  gzip -kf site/style.css
+  ./pack site site.bundle >/dev/null
+  start_server -b site.bundle
+  [ "$(curl /)" = "hi" ]
+  [ "$(curl sub/)" = "sub" ]
+  [ "$(curl_status style.css)" -eq 200 ]
+  curl style.css -I | grep -q 'ETag: "'
+  curl style.css -I -H 'Accept-Encoding: deflate, gzip' |
+    grep -q "Content-Encoding: gzip"
+  [ "$(curl style.css -I -H 'Accept-Encoding: gzip;q=0' |
+       grep -c Content-Encoding)" -eq 0 ]
+  [ "$(curl style.css)" = "body {}" ]
+}
+
+@test "Sends cache headers from the policy file" {
+  cat > test.policy <<EOF
+prefix  /static/    public, max-age=31536000, immutable
+ext     html        no-cache
+type    text/plain  public, max-age=3600
+default             private, max-age=60
+EOF
+  mkdir -p static
+  echo hi > static/blah
+  echo hi > index.html
+  echo hi > blah
+  printf '\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\1\0\0\0\1\x08\x06\0\0\0' > picture
+  start_server -c test.policy
+  curl static/blah -I | grep -q "Cache-Control: public, max-age=31536000, immutable"
+  curl / -I | grep -q "Cache-Control: no-cache"
+  curl index.html -I | grep -q "Cache-Control: no-cache"
+  [ "$(curl / -I | grep -c Expires)" -eq 0 ]
+  curl blah -I | grep -q "Cache-Control: public, max-age=3600"
+  curl blah -I | grep -q "Expires: .* GMT"
+  curl picture -I | grep -q "Cache-Control: private, max-age=60"
+}
+
+@test "Limits requests per client" {
+  echo hi > blah
+  start_server -r 1
+  [ "$(curl_status blah)" -eq 200 ]
+  [ "$(curl_status blah)" -eq 429 ]
+  curl blah -I | grep -q "Retry-After: 1"
+}
+
+@test "Limits connections per client" {
+  echo hi > blah
+  start_server -l 1
+  # holds the only connection this client is allowed
+  exec 4<>"/dev/tcp/localhost/$SERVER_PORT"
+  [ "$(curl_status blah)" -eq 429 ]
+  exec 4<&-
+  sleep 0.2
+  [ "$(curl_status blah)" -eq 200 ]
+}
+
+@test "Writes traces on SIGUSR1" {
+  echo hi > blah
+  rm -f "$BATS_TMPDIR"/test-trace-*.json
+  start_server -t 1 -o "$BATS_TMPDIR/test-trace"
+  [ "$(curl blah)" = "hi" ]
+  kill -USR1 "$SERVER_PID"
+  sleep 0.2
+  TRACE="$BATS_TMPDIR/test-trace-$SERVER_PID-0.json"
+  grep -q '"traceEvents"' "$TRACE"
+  for span in spawn poll recv parse stat open mmap handle_request send; do
+    grep -q "\"name\":\"$span\",\"cat\":\"request\",\"ph\":\"X\"" "$TRACE"
+  done
+  rm "$TRACE"
+}
+
+@test "Refuses to write traces where they can be downloaded" {
+  run ./main -t 1 -o trace "$(( PORT + BATS_TEST_NUMBER ))"
+  [ "$status" -eq 14 ]
+  run ./main -t 1 -o "$PWD/trace" "$(( PORT + BATS_TEST_NUMBER ))"
+  [ "$status" -eq 14 ]
+}
+
+@test "Hands off the socket on SIGUSR2" {
+  echo hi > blah
+  start_server
+  kill -USR2 "$SERVER_PID"
+  for i in 1 2 3 4 5; do
+    [ "$(curl_status blah)" -eq 200 ]
+  done
+  # the old process exits once it has no connections left
+  wait "$SERVER_PID" || true
+  [ "$(curl_status blah)" -eq 200 ]
+  NEW_PID=$(pgrep -f "^\./main $SERVER_PORT\$")
+  [ -n "$NEW_PID" ]
+  [ "$NEW_PID" != "$SERVER_PID" ]
+}